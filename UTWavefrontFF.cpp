@@ -8,13 +8,16 @@
 #include <sstream>
 #include <string>
 #include <mutex>
+#include <set>
 #include <ff/ff.hpp>
 #include <ff/parallel_for.hpp>
 #include "hpc_helpers.hpp"
 #include "utils.hpp"
+#include "tile_store.hpp"
 
 using namespace ff;
 #define MAXWORKERS 16 // Max allowed workers for ParallelFor
+#define CACHEMB 1024 // Default in-memory tile cache budget (MB) for the out-of-core policy
 
 // Working function
 void work(uint64_t k, uint64_t i, std::vector<double> &M, const uint64_t &N){
@@ -62,74 +65,304 @@ void sequentialWavefront(std::vector<double> &M, const uint64_t &N, const uint64
 	}
 }
 
-// Main body loop
-void run(uint64_t N, uint64_t threadNum, uint64_t policy, uint64_t chunkSize,
-	uint64_t tileSize, const std::string& filename, uint64_t maxworkers){
-	
-	// allocate the matrix
-	std::vector<double> M(N*N, 0.0);
+// work function computed across tile (a, b) of a TileStore. rowPanel holds the tiles (a, a..b) side by side
+// and colPanel the tiles (a..b, b) one below the other: this is everything cell (i, j) reads. Computed
+// values are written to both panels, since tile (a, b) is the last tile of rowPanel and the first of colPanel.
+void panelTileWork(uint64_t a, uint64_t b, std::vector<double> &rowPanel, std::vector<double> &colPanel,
+	const uint64_t &N, uint64_t tileSize){
+	uint64_t width = (b - a + 1) * tileSize; // rowPanel columns == colPanel rows
+	uint64_t base = a * tileSize; // first row and first column covered by the panels
+	uint64_t minY = b * tileSize;
+	uint64_t maxY = std::min(minY + tileSize, N);
+	for (uint64_t i = std::min(base + tileSize, N); i-- > base;){
+		for (uint64_t j = std::max(minY, i + 1); j < maxY; j++){
+			double sum = 0.0;
+			for (uint64_t h = 0; h < j - i; h++)
+				sum += rowPanel[(i - base)*width + (i + h - base)] * colPanel[(j - h - base)*tileSize + (j - minY)];
+			sum = std::cbrt(sum);
+			rowPanel[(i - base)*width + (j - base)] = sum;
+			colPanel[(i - base)*tileSize + (j - minY)] = sum;
+		}
+	}
+}
+
+// Tiles of the panels of tile (a, b) that are already final while tile diagonal K is being computed,
+// in the order they are copied; tile (a, b) itself is left out
+std::vector<std::pair<uint64_t, uint64_t>> panelTiles(uint64_t a, uint64_t b, uint64_t K){
+	std::vector<std::pair<uint64_t, uint64_t>> tiles;
+	for (uint64_t t = a; t < b; t++){
+		if (t - a < K) tiles.emplace_back(a, t);
+		if (b - (t + 1) < K) tiles.emplace_back(t + 1, b);
+	}
+	return tiles;
+}
+
+// Tiles reserved for a tile of the out-of-core wavefront, until it starts
+struct PanelReservation {
+	bool started = false;
+	std::vector<std::pair<uint64_t, uint64_t>> tiles;
+};
+
+// Out-of-core version: the matrix lives in a TileStore and only the panels of the tiles being computed
+// (plus the tile cache) are in memory. Each tile diagonal is a ParallelFor with dynamic scheduling, so
+// tiles start roughly in order and each worker can prefetch the first panel tiles of the tile nworkers
+// positions ahead, possibly on the next diagonal; while copying its own panels, a worker keeps prefetching
+// the tiles budget positions ahead of the copy. Prefetched tiles stay reserved until they are copied;
+// both the tile being copied and the one ahead reserve at most budget tiles, so that the reservations of
+// all workers fit in the cache. Finished tiles are written back by the store in the background.
+void outOfCoreWavefront(TileStore &store, const uint64_t &N, uint64_t nworkers, uint64_t maxworkers){
+	uint64_t tileSize = store.tileSize();
+	uint64_t numTiles = store.numTiles();
+	ParallelFor pf(maxworkers);
+	uint64_t budget = std::max<uint64_t>(store.cacheTiles() / (2 * nworkers), 1);
+	// Reservations for the tiles of the current (K % 2) and the next tile diagonal, by tile row
+	std::vector<PanelReservation> reservations[2];
+	reservations[0].resize(numTiles);
+	// First TileStore error: the remaining tiles are skipped and it is rethrown after the tile diagonal
+	std::exception_ptr error;
+	std::mutex lock;
+
+	// Reserve the first panel tiles of tile a2 on tile diagonal K2 while computing diagonal K, unless it has started
+	auto reserve = [&](uint64_t a2, uint64_t K2, uint64_t K){
+		std::lock_guard<std::mutex> guard(lock);
+		PanelReservation &reservation = reservations[K2 % 2][a2];
+		if (reservation.started) return;
+		for (const auto &[x, y] : panelTiles(a2, a2 + K2, K)){
+			if (reservation.tiles.size() >= budget) break;
+			if (store.prefetch(x, y)) reservation.tiles.emplace_back(x, y);
+		}
+	};
+
+	for (uint64_t K = 0; K < numTiles; K++){
+		uint64_t count = numTiles - K; // Tiles on the current tile diagonal
+		// Every tile of diagonal K - 1 has started, so none of its reservations is left
+		reservations[(K + 1) % 2].assign(numTiles, PanelReservation());
+		pf.parallel_for(0, count, 1, 1, [&](const uint64_t a){
+			std::set<std::pair<uint64_t, uint64_t>> reserved;
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if (error) return;
+				reservations[K % 2][a].started = true;
+				reserved.insert(reservations[K % 2][a].tiles.begin(), reservations[K % 2][a].tiles.end());
+			}
+			try {
+				uint64_t next = a + nworkers;
+				if (next < count) reserve(next, K, K);
+				else if (next - count + 1 < count) reserve(next - count, K + 1, K);
+
+				uint64_t b = a + K;
+				uint64_t width = (K + 1) * tileSize;
+				std::vector<double> rowPanel(tileSize * width, 0.0);
+				std::vector<double> colPanel(width * tileSize, 0.0);
+				// Tile (a, b) itself is still all zeros, unless it is on the main diagonal
+				std::vector<std::pair<uint64_t, uint64_t>> panel = panelTiles(a, b, K);
+				if (K == 0) panel.emplace_back(a, b);
+				for (uint64_t p = 0; p < panel.size(); p++){
+					if (p + budget < panel.size() && !reserved.count(panel[p + budget])
+						&& store.prefetch(panel[p + budget].first, panel[p + budget].second))
+						reserved.insert(panel[p + budget]);
+					auto [x, y] = panel[p];
+					TilePtr tile = store.get(x, y);
+					if (x == a){
+						for (uint64_t r = 0; r < tileSize; r++)
+							std::copy_n(tile->begin() + r * tileSize, tileSize, rowPanel.begin() + r * width + (y - a) * tileSize);
+					}
+					if (y == b) std::copy(tile->begin(), tile->end(), colPanel.begin() + (x - a) * tileSize * tileSize);
+					if (reserved.erase(panel[p])) store.release(x, y);
+				}
+				panelTileWork(a, b, rowPanel, colPanel, N, tileSize);
+				store.put(a, b, std::make_shared<Tile>(colPanel.begin(), colPanel.begin() + tileSize * tileSize));
+			} catch (...) {
+				std::lock_guard<std::mutex> guard(lock);
+				if (!error) error = std::current_exception();
+			}
+		}, nworkers);
+		if (error) std::rethrow_exception(error);
+	}
+	store.flush();
+}
+
+// tileWork restricted to the cells that depend on a changed main diagonal entry, i.e. j >= nextChanged[i]
+// (the first changed index not below i). The row checksums are updated with the XOR of old and new values.
+void dirtyTileWork(uint64_t minX, uint64_t minY, uint64_t maxX, uint64_t maxY,
+	std::vector<double> &M, const uint64_t &N, const std::vector<uint64_t> &nextChanged,
+	std::vector<uint64_t> &rowChecksums){
+	for (uint64_t i = std::min(maxX, N - 1) + 1; i-- > minX;){
+		for (uint64_t j = std::max({minY, i + 1, nextChanged[i]}); j <= std::min(maxY, N - 1); j++){
+			uint64_t old = (uint64_t)M[i*N + j];
+			work(j - i, i, M, N);
+			rowChecksums[i] = rowChecksums[i] ^ old ^ (uint64_t)M[i*N + j];
+		}
+	}
+}
 
+// Incremental version: sets the main diagonal entries in changes (position, new value) on a previously
+// computed M and recomputes only the cells (i, j) with i <= p <= j for some changed p, skipping clean tiles.
+// rowChecksums must hold computeRowChecksums() of the previous M: it is updated in place and the new
+// checksum is returned, so that the cost stays proportional to the recomputed cells.
+uint64_t incrementalWavefront(std::vector<double> &M, const uint64_t &N, uint64_t tileSize,
+	const std::vector<std::pair<uint64_t, double>> &changes, std::vector<uint64_t> &rowChecksums,
+	uint64_t nworkers, uint64_t maxworkers){
+	assert(rowChecksums.size() == N);
+	std::vector<uint64_t> nextChanged(N + 1, N);
+	uint64_t maxChanged = 0;
+	for (const auto &[p, value] : changes){
+		assert(p < N);
+		rowChecksums[p] = rowChecksums[p] ^ (uint64_t)M[p*N + p] ^ (uint64_t)value;
+		M[p*N + p] = value;
+		nextChanged[p] = p;
+		maxChanged = std::max(maxChanged, p);
+	}
+	if (changes.empty()) return sumRowChecksums(rowChecksums);
+	for (uint64_t i = N; i-- > 0;) nextChanged[i] = std::min(nextChanged[i], nextChanged[i + 1]);
+
+	ParallelFor pf(maxworkers);
+	for (uint64_t K = 0; K < N; K += tileSize){
+		// Tiles starting below the last changed row are clean
+		uint64_t numTiles = std::min((N - K + tileSize - 1) / tileSize, maxChanged / tileSize + 1);
+		pf.parallel_for(0, numTiles, [&](const uint64_t i){
+				uint64_t minX = tileSize * i;
+				uint64_t minY = minX + K;
+				uint64_t maxY = std::min(minY + tileSize - 1, N - 1);
+				if (minY < N and nextChanged[minX] <= maxY)
+					dirtyTileWork(minX, minY, minX + tileSize - 1, maxY, M, N, nextChanged, rowChecksums);
+		}, nworkers);
+	}
+	return sumRowChecksums(rowChecksums);
+}
+
+// Main body loop, returns the process exit status
+int run(uint64_t N, uint64_t threadNum, uint64_t policy, uint64_t chunkSize,
+	uint64_t tileSize, const std::string& filename, uint64_t maxworkers,
+	uint64_t cacheMB, const std::string& storePath, uint64_t changes){
+	
 	std::ofstream output_file;
 	output_file.open(filename, std::ios_base::app);
 
 	output_file << N << "," << threadNum << "," << policy << "," << tileSize << "," << chunkSize;
 
-	// init function
-	auto init=[&]() {
-		for (uint64_t i = 0; i < N; i++){
-			M[i*N + i] = (i + 1.) / (double)N;
+	// TileStore I/O errors (creation, init, run, checksum) end the run with exit status 1
+	try {
+		// allocate the matrix (on disk for the out-of-core policy)
+		std::vector<double> M(policy == 4 ? 0 : N*N, 0.0);
+		std::unique_ptr<TileStore> store;
+		if (policy == 4){
+			uint64_t cacheTiles = TileStore::tilesInBudget(cacheMB * 1024 * 1024, tileSize);
+			store = std::make_unique<TileStore>(storePath, N, tileSize, cacheTiles);
 		}
-	};
+
+		// init function
+		auto init=[&]() {
+			if (store){
+				for (uint64_t a = 0; a < store->numTiles(); a++){
+					TilePtr tile = std::make_shared<Tile>(tileSize * tileSize, 0.0);
+					for (uint64_t i = a * tileSize; i < std::min((a + 1) * tileSize, N); i++)
+						(*tile)[(i - a * tileSize) * (tileSize + 1)] = (i + 1.) / (double)N;
+					store->put(a, a, tile);
+				}
+				store->flush();
+				return;
+			}
+			for (uint64_t i = 0; i < N; i++){
+				M[i*N + i] = (i + 1.) / (double)N;
+			}
+		};
 	
-	init();
-
-	auto task = [&](std::vector<double> &M, const uint64_t &N, uint64_t nworkers, long chunk, uint64_t tileSize){
-		ParallelFor name(maxworkers);
-		for (uint64_t K = 0; K < N; K += tileSize){
-			uint64_t numTiles = (N - K + tileSize - 1) / tileSize;
-			name.parallel_for(0, numTiles, [&](const uint64_t i){
-					// Compute coordinates
-					uint64_t minX, minY, maxX, maxY;
-					minX = tileSize * i;
-					minY = minX + K;
-					maxX = std::min(minX + tileSize - 1, N);
-					maxY = std::min(minY + tileSize - 1, N);
-					if (minX < N and minY < N) tileWork(minX, minY, maxX, maxY, M, N, K);
-			}, nworkers);
-		}
-	};
+		init();
+
+		auto task = [&](std::vector<double> &M, const uint64_t &N, uint64_t nworkers, long chunk, uint64_t tileSize){
+			ParallelFor name(maxworkers);
+			for (uint64_t K = 0; K < N; K += tileSize){
+				uint64_t numTiles = (N - K + tileSize - 1) / tileSize;
+				name.parallel_for(0, numTiles, [&](const uint64_t i){
+						// Compute coordinates
+						uint64_t minX, minY, maxX, maxY;
+						minX = tileSize * i;
+						minY = minX + K;
+						maxX = std::min(minX + tileSize - 1, N);
+						maxY = std::min(minY + tileSize - 1, N);
+						if (minX < N and minY < N) tileWork(minX, minY, maxX, maxY, M, N, K);
+				}, nworkers);
+			}
+		};
 
-	// Policy #1: block distribution along a (possibly tiled) diagonal
-	auto blockWavefront = [&](std::vector<double> &M, const uint64_t &N,
-		uint64_t nworkers, uint64_t tileSize){ task(M, N, nworkers, 0, tileSize); };
+		// Policy #1: block distribution along a (possibly tiled) diagonal
+		auto blockWavefront = [&](std::vector<double> &M, const uint64_t &N,
+			uint64_t nworkers, uint64_t tileSize){ task(M, N, nworkers, 0, tileSize); };
+	
+		// Cyclic distribution policy along a (possibly tiled) diagonal
+		auto cyclicWavefront = [&](std::vector<double> &M, const uint64_t &N,
+			uint64_t nworkers, uint64_t tileSize){ task(M, N, nworkers, 1, tileSize); };
 	
-	// Cyclic distribution policy along a (possibly tiled) diagonal
-	auto cyclicWavefront = [&](std::vector<double> &M, const uint64_t &N,
-		uint64_t nworkers, uint64_t tileSize){ task(M, N, nworkers, 1, tileSize); };
+		// Block Cyclic distribution policy along a (possibly tiled) diagonal
+		auto blockCyclicWavefront = [&](std::vector<double> &M, const uint64_t &N,
+			uint64_t nworkers, uint64_t tileSize, uint64_t chunkSize){ task(M, N, nworkers, chunkSize, tileSize); };
 	
-	// Block Cyclic distribution policy along a (possibly tiled) diagonal
-	auto blockCyclicWavefront = [&](std::vector<double> &M, const uint64_t &N,
-		uint64_t nworkers, uint64_t tileSize, uint64_t chunkSize){ task(M, N, nworkers, chunkSize, tileSize); };
+		// In-memory policies
+		auto wavefront = [&](){
+			if (policy == 0){
+				sequentialWavefront(M, N, tileSize);
+			} else if (policy == 1){ // block policy
+				blockWavefront(M, N, threadNum, tileSize);
+			} else if (policy == 2){ // cyclic policy
+				cyclicWavefront(M, N, threadNum, tileSize);
+			} else if (policy == 3){
+				blockCyclicWavefront(M, N, threadNum, tileSize, chunkSize);
+			}
+		};
 	
-	TIMERSTART(wavefront, 1000, "", output_file, ","); // Milliseconds
-	std::cout << "Using " << threadNum << " threads" << std::endl;
-	// Now spawn the threads and go
-	if (policy == 0){
-		sequentialWavefront(M, N, tileSize);
-	} else if (policy == 1){ // block policy
-		blockWavefront(M, N, threadNum, tileSize);
-	} else if (policy == 2){ // cyclic policy
-		cyclicWavefront(M, N, threadNum, tileSize);
-	} else if (policy == 3){
-		blockCyclicWavefront(M, N, threadNum, tileSize, chunkSize);
-	} else {
-		std::cerr << "Error: invalid policy id " << policy << std::endl;
+		TIMERSTART(wavefront, 1000, "", output_file, ","); // Milliseconds
+		std::cout << "Using " << threadNum << " threads" << std::endl;
+		// Now spawn the threads and go
+		if (policy <= 3){
+			wavefront();
+		} else if (policy == 4){ // out-of-core, dynamic scheduling, chunk 1
+			outOfCoreWavefront(*store, N, threadNum, maxworkers);
+		} else {
+			std::cerr << "Error: invalid policy id " << policy << std::endl;
+		}
+		// join each thread at the end
+	    TIMERSTOP(wavefront, 1000, "", output_file, ","); // Milliseconds
+		uint64_t checksum = store ? store->checksum() : computeChecksum(M, N);
+		output_file << checksum << std::endl;
+		std::cout << checksum << std::endl;
+
+		// Incremental recomputation after setting `changes` random entries of the main diagonal,
+		// checked against a full recompute of the re-initialized matrix with the same entries
+		if (changes > 0 && policy == 4){
+			std::cerr << "Error: incremental recomputation is not supported by the out-of-core policy, "
+				<< "ignoring changes = " << changes << std::endl;
+		} else if (changes > 0 && policy <= 3){
+			std::vector<uint64_t> rowChecksums = computeRowChecksums(M, N);
+			std::mt19937 gen(42);
+			std::uniform_int_distribution<uint64_t> position(0, N - 1);
+			std::uniform_real_distribution<double> value(0.0, 1.0);
+			std::vector<std::pair<uint64_t, double>> updates;
+			for (uint64_t c = 0; c < changes; c++) updates.emplace_back(position(gen), value(gen));
+			TIMERSTART(incremental, 1000, " (ms)", std::cout, "Incremental recomputation: ");
+			checksum = incrementalWavefront(M, N, tileSize, updates, rowChecksums, threadNum, maxworkers);
+			TIMERSTOP(incremental, 1000, " (ms)", std::cout, "Incremental recomputation: ");
+			std::cout << checksum << std::endl;
+
+			std::vector<double> incrementalM(N*N, 0.0);
+			incrementalM.swap(M);
+			init();
+			for (const auto &[p, value] : updates) M[p*N + p] = value;
+			wavefront();
+			if (M != incrementalM || checksum != computeChecksum(M, N)){
+				std::cerr << "Error: incremental recomputation differs from a full recompute" << std::endl;
+				output_file.close();
+				return 1;
+			}
+			std::cout << "Incremental recomputation matches a full recompute" << std::endl;
+		}
+	} catch (const std::exception &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		output_file << std::endl;
+		return 1;
 	}
-	// join each thread at the end
-    TIMERSTOP(wavefront, 1000, "", output_file, ","); // Milliseconds
-	output_file << computeChecksum(M, N) << std::endl;
-	std::cout << computeChecksum(M, N) << std::endl;
 	output_file.close();
+	return 0;
 }
 
 
@@ -142,9 +375,11 @@ int main(int argc, char *argv[]) {
 	uint64_t chunkSize = argc > 5 ? std::stol(argv[5]) : 128;
 	uint64_t maxworkers = argc > 6 ? std::stol(argv[6]) : MAXWORKERS;
 	if (argc > 7) filename = argv[7];
+	uint64_t cacheMB = argc > 8 ? std::stol(argv[8]) : CACHEMB;
+	std::string storePath = argc > 9 ? argv[9] : "wavefront_tiles.bin";
+	uint64_t changes = argc > 10 ? std::stol(argv[10]) : 0;
 	std::cout << "N = " << N << " policy = " << policy << " tileSize = " << 
 	tileSize << " threadNum = " << threadNum << " chunkSize = " << chunkSize << "\n";
 
-	run(N, threadNum, policy, chunkSize, tileSize, filename, maxworkers);
-    return 0;
+	return run(N, threadNum, policy, chunkSize, tileSize, filename, maxworkers, cacheMB, storePath, changes);
 }
\ No newline at end of file
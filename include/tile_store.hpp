@@ -0,0 +1,346 @@
+#ifndef TILE_STORE_HPP
+#define TILE_STORE_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+using Tile = std::vector<double>;
+using TilePtr = std::shared_ptr<Tile>;
+
+/**
+ * File-backed store for the upper triangle of an N x N matrix, split into tileSize x tileSize tiles.
+ * Tile (a, b), a <= b, holds rows [a*tileSize, (a+1)*tileSize) and columns [b*tileSize, (b+1)*tileSize)
+ * and is saved row-major in the file, which packs the upper triangle of tiles row by row. Border
+ * tiles are zero-padded. At most cacheTiles tiles are kept in memory (LRU), besides those that cannot be
+ * evicted: reserved by prefetch(), dirty or still referenced by a caller. prefetch() stops reserving and
+ * put() blocks at cacheTiles reserved and dirty tiles respectively, so only tiles in use exceed the bound.
+ * A loader thread loads reserved tiles and a writer thread writes put() tiles back in the background.
+ */
+class TileStore {
+public:
+    TileStore(const std::string& path, uint64_t N, uint64_t tileSize, uint64_t cacheTiles)
+        : path(path), N(N), T(tileSize), nt((N + tileSize - 1) / tileSize),
+          capacity(std::max<uint64_t>(cacheTiles, 1)) {
+        // The store is a scratch file removed by the destructor: never reuse an existing file
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to create tile store " + path + (errno == EEXIST ? " (file exists)" : ""));
+        }
+        // Never written tiles read back as zeros
+        if (ftruncate(fd, (off_t)(nt * (nt + 1) / 2 * tileBytes())) != 0) {
+            close(fd);
+            unlink(path.c_str());
+            throw std::runtime_error("Failed to resize tile store " + path);
+        }
+        loader = std::thread([this]{ loaderLoop(); });
+        writer = std::thread([this]{ writerLoop(); });
+    }
+
+    TileStore(const TileStore&) = delete;
+    TileStore& operator=(const TileStore&) = delete;
+
+    ~TileStore() {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            flushed.wait(lock, [this]{ return writeQueue.empty() && writing == 0; });
+            stopping = true;
+        }
+        loadReady.notify_all();
+        writeReady.notify_all();
+        loader.join();
+        writer.join();
+        close(fd);
+        unlink(path.c_str());
+    }
+
+    // Number of tiles that fit in a cache of the given size, counting the bookkeeping of each cached tile:
+    // the Tile and its shared_ptr control block, the hash map node and bucket and the LRU list node, plus
+    // an allocator header for each of the four allocations. It dominates the payload for small tiles.
+    static uint64_t tilesInBudget(uint64_t bytes, uint64_t tileSize) {
+        uint64_t overhead = sizeof(Tile) + 2 * sizeof(long)
+            + sizeof(std::pair<const uint64_t, Entry>) + 3 * sizeof(void*)
+            + sizeof(uint64_t) + 2 * sizeof(void*)
+            + 4 * 2 * sizeof(void*);
+        return bytes / (tileSize * tileSize * sizeof(double) + overhead);
+    }
+
+    uint64_t numTiles() const { return nt; }
+    uint64_t tileSize() const { return T; }
+    uint64_t cacheTiles() const { return capacity; }
+
+    // Returns tile (a, b), reading it from the file on a cache miss or waiting for a pending prefetch
+    TilePtr get(uint64_t a, uint64_t b) {
+        uint64_t id = tileId(a, b);
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            checkError();
+            // Entries still being loaded are reserved, hence never evicted before they are
+            loaded.wait(lock, [&]{
+                auto it = cache.find(id);
+                return error || it == cache.end() || it->second.tile;
+            });
+            checkError();
+            TilePtr tile = lookup(id);
+            if (tile) return tile;
+        }
+        TilePtr tile = readTile(id);
+        std::lock_guard<std::mutex> lock(mtx);
+        return insert(id, std::move(tile), false);
+    }
+
+    // Replaces tile (a, b) and queues it for write-back, once fewer than cacheTiles tiles are dirty
+    void put(uint64_t a, uint64_t b, TilePtr tile) {
+        uint64_t id = tileId(a, b);
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            flushed.wait(lock, [this]{ return error || dirtyTiles < capacity; });
+            checkError();
+            insert(id, std::move(tile), true);
+            writeQueue.push_back(id);
+        }
+        writeReady.notify_one();
+    }
+
+    // Reserves tile (a, b), which is loaded asynchronously if not cached and is not evicted until
+    // release(a, b). Returns false, reserving nothing, while cacheTiles reservations are held.
+    bool prefetch(uint64_t a, uint64_t b) {
+        uint64_t id = tileId(a, b);
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (error || reservedTiles >= capacity) return false;
+            reservedTiles++;
+            auto it = cache.find(id);
+            if (it != cache.end()) {
+                it->second.reserved++;
+                return true;
+            }
+            lru.push_front(id);
+            cache[id] = {nullptr, false, 1, lru.begin()};
+            loadQueue.push_back(id);
+            evict();
+        }
+        loadReady.notify_one();
+        return true;
+    }
+
+    // Drops a reservation taken by prefetch(a, b)
+    void release(uint64_t a, uint64_t b) {
+        uint64_t id = tileId(a, b);
+        std::lock_guard<std::mutex> lock(mtx);
+        Entry& entry = cache.at(id);
+        assert(entry.reserved > 0);
+        entry.reserved--;
+        reservedTiles--;
+        evict();
+    }
+
+    // Waits until every put() tile has reached the file
+    void flush() {
+        std::unique_lock<std::mutex> lock(mtx);
+        flushed.wait(lock, [this]{ return writeQueue.empty() && writing == 0; });
+        checkError();
+    }
+
+    // Same value as computeChecksum() on the equivalent in-memory matrix (lower triangle is zero)
+    uint64_t checksum() {
+        flush();
+        std::vector<uint64_t> results(N, 0);
+        for (uint64_t a = 0; a < nt; a++) {
+            for (uint64_t b = a; b < nt; b++) {
+                TilePtr tile = get(a, b);
+                for (uint64_t r = 0; r < T && a * T + r < N; r++) {
+                    for (uint64_t c = 0; c < T && b * T + c < N; c++)
+                        results[a * T + r] = results[a * T + r] ^ (uint64_t)(*tile)[r * T + c];
+                }
+            }
+        }
+        uint64_t final = 0;
+        for (uint64_t i = 0; i < N; i++) final = final + results[i];
+        return final;
+    }
+
+private:
+    struct Entry {
+        TilePtr tile;
+        bool dirty;
+        uint64_t reserved; // pending prefetch() reservations
+        std::list<uint64_t>::iterator pos;
+    };
+
+    // Must hold mtx. A failed write-back (its tile exists only in memory) or prefetch read makes the store unusable
+    void checkError() {
+        if (error) std::rethrow_exception(error);
+    }
+
+    uint64_t tileBytes() const { return T * T * sizeof(double); }
+
+    uint64_t tileId(uint64_t a, uint64_t b) const {
+        assert(a <= b && b < nt);
+        return a * nt - a * (a - 1) / 2 + (b - a);
+    }
+
+    // Must hold mtx
+    TilePtr lookup(uint64_t id) {
+        auto it = cache.find(id);
+        if (it == cache.end()) return nullptr;
+        lru.splice(lru.begin(), lru, it->second.pos);
+        return it->second.tile;
+    }
+
+    // Must hold mtx. Adds a tile to the cache and returns the cached copy; a clean tile never replaces a cached one
+    TilePtr insert(uint64_t id, TilePtr tile, bool dirty) {
+        auto it = cache.find(id);
+        if (it != cache.end()) {
+            lru.splice(lru.begin(), lru, it->second.pos);
+            // A reserved entry has no tile until it is loaded
+            if (dirty || !it->second.tile) {
+                if (dirty && !it->second.dirty) dirtyTiles++;
+                it->second.dirty = it->second.dirty || dirty;
+                it->second.tile = std::move(tile);
+                loaded.notify_all();
+            }
+            return it->second.tile;
+        }
+        if (dirty) dirtyTiles++;
+        lru.push_front(id);
+        Entry& entry = cache[id];
+        entry = {std::move(tile), dirty, 0, lru.begin()};
+        TilePtr result = entry.tile;
+        evict();
+        return result;
+    }
+
+    // Must hold mtx. Callers only copy TilePtrs under mtx, so use_count() == 1 means unreferenced
+    void evict() {
+        auto it = lru.end();
+        while (cache.size() > capacity && it != lru.begin()) {
+            --it;
+            Entry& entry = cache[*it];
+            if (entry.dirty || entry.reserved > 0 || !entry.tile || entry.tile.use_count() > 1) continue;
+            cache.erase(*it);
+            it = lru.erase(it);
+        }
+    }
+
+    TilePtr readTile(uint64_t id) {
+        TilePtr tile = std::make_shared<Tile>(T * T, 0.0);
+        char* buf = reinterpret_cast<char*>(tile->data());
+        uint64_t done = 0;
+        while (done < tileBytes()) {
+            ssize_t n = pread(fd, buf + done, tileBytes() - done, (off_t)(id * tileBytes() + done));
+            if (n <= 0) throw std::runtime_error("Failed to read tile from " + path);
+            done += n;
+        }
+        return tile;
+    }
+
+    void writeTile(uint64_t id, const Tile& tile) {
+        const char* buf = reinterpret_cast<const char*>(tile.data());
+        uint64_t done = 0;
+        while (done < tileBytes()) {
+            ssize_t n = pwrite(fd, buf + done, tileBytes() - done, (off_t)(id * tileBytes() + done));
+            if (n <= 0) throw std::runtime_error("Failed to write tile to " + path);
+            done += n;
+        }
+    }
+
+    void loaderLoop() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            loadReady.wait(lock, [this]{ return stopping || !loadQueue.empty(); });
+            if (stopping) return;
+            uint64_t id = loadQueue.front();
+            loadQueue.pop_front();
+            // Already loaded by a get() miss, and possibly released and evicted since
+            auto it = cache.find(id);
+            if (it == cache.end() || it->second.tile) continue;
+            lock.unlock();
+            TilePtr tile;
+            try {
+                tile = readTile(id);
+            } catch (...) {
+                std::lock_guard<std::mutex> errLock(mtx);
+                if (!error) error = std::current_exception();
+            }
+            lock.lock();
+            if (tile) {
+                insert(id, std::move(tile), false);
+            } else {
+                loaded.notify_all();
+                flushed.notify_all();
+            }
+        }
+    }
+
+    void writerLoop() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            writeReady.wait(lock, [this]{ return stopping || !writeQueue.empty(); });
+            if (writeQueue.empty()) return;
+            uint64_t id = writeQueue.front();
+            writeQueue.pop_front();
+            // A tile put() twice is queued twice: the first write may already have cleaned it, and
+            // then it may have been evicted. Dirty entries are never evicted.
+            auto it = cache.find(id);
+            if (it == cache.end() || !it->second.dirty) {
+                flushed.notify_all();
+                continue;
+            }
+            TilePtr tile = it->second.tile;
+            writing++;
+            lock.unlock();
+            bool written = true;
+            try {
+                writeTile(id, *tile);
+            } catch (...) {
+                std::lock_guard<std::mutex> errLock(mtx);
+                if (!error) error = std::current_exception();
+                written = false;
+            }
+            if (!written) loaded.notify_all();
+            lock.lock();
+            // A newer put() of the same tile keeps it dirty until its own write, a failed one keeps it forever
+            it = cache.find(id);
+            if (written && it->second.tile == tile) {
+                it->second.dirty = false;
+                dirtyTiles--;
+            }
+            tile.reset();
+            writing--;
+            evict();
+            flushed.notify_all();
+        }
+    }
+
+    std::string path;
+    uint64_t N, T, nt, capacity;
+    int fd;
+
+    std::mutex mtx;
+    std::unordered_map<uint64_t, Entry> cache;
+    std::list<uint64_t> lru; // most recently used first
+    std::deque<uint64_t> loadQueue, writeQueue;
+    uint64_t writing = 0, dirtyTiles = 0, reservedTiles = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+    std::condition_variable loadReady, writeReady, flushed, loaded;
+    std::thread loader, writer;
+};
+
+#endif
@@ -75,7 +75,8 @@ std::vector<double> readMatrixFromFile(const std::string& filename) {
     return matrix;
 }
 
-uint64_t computeChecksum(std::vector<double>& M, uint64_t& N){
+// XOR of the (truncated) entries of each row; the checksum is their sum
+std::vector<uint64_t> computeRowChecksums(std::vector<double>& M, const uint64_t& N){
     std::vector<uint64_t> results(N, 0);
     for (uint64_t i = 0; i < N; i++){
         uint64_t result = 0;
@@ -83,11 +84,19 @@ uint64_t computeChecksum(std::vector<double>& M, uint64_t& N){
             result = result ^ (uint64_t)M[i*N + j];
         results[i] = result;
     }
+    return results;
+}
+
+uint64_t sumRowChecksums(const std::vector<uint64_t>& results){
     uint64_t final = 0;
-    for (uint64_t i = 0; i < N; i++) final = final + results[i];
+    for (uint64_t i = 0; i < results.size(); i++) final = final + results[i];
     return final;
 }
 
+uint64_t computeChecksum(std::vector<double>& M, uint64_t& N){
+    return sumRowChecksums(computeRowChecksums(M, N));
+}
+
 bool compare_files(const std::string& file1, const std::string& file2) {
     std::ifstream f1(file1, std::ios::binary | std::ios::ate);
     std::ifstream f2(file2, std::ios::binary | std::ios::ate);